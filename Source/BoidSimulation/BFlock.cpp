@@ -10,6 +10,18 @@
 DECLARE_STATS_GROUP(TEXT("BoidProfiling"), STATGROUP_BoidProfiling, STATCAT_Advanced);
 DECLARE_CYCLE_STAT(TEXT("Simulate (GT)"), STAT_Simulate_GameThread, STATGROUP_BoidProfiling);
 DECLARE_CYCLE_STAT(TEXT("Simulate (Task)"), STAT_Simulate_WorkerThread, STATGROUP_BoidProfiling);
+DECLARE_CYCLE_STAT(TEXT("Generate Spawn Data"), STAT_GenerateSpawnData, STATGROUP_BoidProfiling);
+DECLARE_CYCLE_STAT(TEXT("Spawn Instances"), STAT_SpawnInstances, STATGROUP_BoidProfiling);
+DECLARE_CYCLE_STAT(TEXT("Build Neighbor Lists"), STAT_BuildNeighborLists, STATGROUP_BoidProfiling);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Neighbor List Rebuilds (Total)"), STAT_NeighborListRebuilds, STATGROUP_BoidProfiling);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Neighbor Rebuilds Per Frame"), STAT_NeighborRebuildRate, STATGROUP_BoidProfiling);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Frames Since Neighbor Rebuild"), STAT_FramesSinceNeighborRebuild, STATGROUP_BoidProfiling);
+DECLARE_CYCLE_STAT(TEXT("Steering"), STAT_Steering, STATGROUP_BoidProfiling);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Steering Pipeline"), STAT_SteeringPipeline, STATGROUP_BoidProfiling);
+
+// Boids generated per seeded random stream when spawning, and instances added per batch when time-slicing
+static constexpr int32 SpawnChunkSize = 4096;
+static constexpr int32 SpawnBatchSize = 1024;
 
 ABFlock::ABFlock()
 {
@@ -40,32 +52,100 @@ void ABFlock::BeginPlay()
 
 	Box->SetBoxExtent(FVector{SpreadRadius});
 	// Box->GetComponentLocation()
-	
-	// Update buffers and clear instances
-	UpdateBuffers(NumInstances);
-	InstanceIndices.SetNum(NumInstances);
 
 	if ( GetInstanceCount() != 0) ISMComp->ClearInstances();
 
-	// Spawn instances with random transforms
-	TArray<FTransform> Transforms;
-	Transforms.Reserve(NumInstances);
-		
-	FVector SpawnPoint = FVector::ZeroVector;
-	for (int32 i = 0; i < NumInstances; i++)    
+	// Size every buffer once up front
+	UpdateBuffers(NumInstances);
+	InstanceIndices.Reset(NumInstances);
+	ISMComp->PreAllocateInstancesMemory(NumInstances);
+
+	GenerateSpawnData();
+
+	// With a budget the remainder is spawned from Tick over the next frames
+	SpawnPendingInstances(SpawnBudgetMs);
+
+	// SpreadRadius += GetActorLocation().Size();
+}
+
+void ABFlock::GenerateSpawnData()
+{
+	SCOPE_CYCLE_COUNTER(STAT_GenerateSpawnData);
+
+	PendingSpawnTransforms.SetNumUninitialized(NumInstances);
+	PendingSpawnCursor = 0;
+
+	const FVector BoxCenter = Box->GetComponentLocation();
+	const FVector HalfSize = Box->GetUnscaledBoxExtent() / 2.f;
+	const FBox SpawnBox(BoxCenter - HalfSize, BoxCenter + HalfSize);
+
+	// Instances are added in component space so ISMComp doesn't have to convert each one
+	const FTransform ComponentTransform = ISMComp->GetComponentTransform();
+
+	const int32 NumChunks = FMath::DivideAndRoundUp(NumInstances, SpawnChunkSize);
+	ParallelFor(NumChunks, [&](const int32 ChunkIndex) -> void
 	{
-		SpawnPoint = RandomPointInBoundingBox(Box->GetComponentLocation(),Box->GetUnscaledBoxExtent() / 2.f );
-		
-		FRotator RandomRotator = FRotator(0.f,
-										FMath::RandRange(0.f, 359.998993f),
-										0.f);
+		FRandomStream Stream(static_cast<int32>(HashCombine(GetTypeHash(SpawnSeed), GetTypeHash(ChunkIndex))));
+
+		const int32 First = ChunkIndex * SpawnChunkSize;
+		const int32 Last = FMath::Min(First + SpawnChunkSize, NumInstances);
+		for (int32 i = First; i < Last; ++i)
+		{
+			const FVector SpawnPoint = Stream.RandPointInBox(SpawnBox);
+			const FRotator RandomRotator = FRotator(0.f, Stream.FRandRange(0.f, 359.998993f), 0.f);
 
-		FTransform Transform(RandomRotator, SpawnPoint, InitialSpawnScale);
-		Transforms.Add(Transform);
+			BoidCurrentLocations[i] = SpawnPoint;
+			BoidsVelocities[i] = RandomRotator.Vector() * Stream.FRandRange(MinMovementSpeed, MaxMovementSpeed);
+
+			const FTransform Transform(RandomRotator, SpawnPoint, InitialSpawnScale);
+			PendingSpawnTransforms[i] = Transform.GetRelativeTransform(ComponentTransform);
+		}
+	});
+}
+
+void ABFlock::SpawnPendingInstances(const float BudgetMs)
+{
+	SCOPE_CYCLE_COUNTER(STAT_SpawnInstances);
+
+	if (BudgetMs <= 0.f)
+	{
+		// Everything that is left goes in as one batch
+		if (PendingSpawnCursor == 0)
+		{
+			InstanceIndices.Append(ISMComp->AddInstances(PendingSpawnTransforms, true, false));
+		}
+		else
+		{
+			const TArray<FTransform> Remaining(PendingSpawnTransforms.GetData() + PendingSpawnCursor, PendingSpawnTransforms.Num() - PendingSpawnCursor);
+			InstanceIndices.Append(ISMComp->AddInstances(Remaining, true, false));
+		}
+		PendingSpawnCursor = PendingSpawnTransforms.Num();
 	}
-	InstanceIndices = ISMComp->AddInstances(Transforms, true, true);
+	else
+	{
+		const double StartTime = FPlatformTime::Seconds();
 
-	// SpreadRadius += GetActorLocation().Size();
+		TArray<FTransform> Batch;
+		Batch.Reserve(SpawnBatchSize);
+
+		while (IsSpawnPending())
+		{
+			const int32 BatchCount = FMath::Min(SpawnBatchSize, PendingSpawnTransforms.Num() - PendingSpawnCursor);
+			Batch.Reset();
+			Batch.Append(PendingSpawnTransforms.GetData() + PendingSpawnCursor, BatchCount);
+
+			InstanceIndices.Append(ISMComp->AddInstances(Batch, true, false));
+			PendingSpawnCursor += BatchCount;
+
+			if ((FPlatformTime::Seconds() - StartTime) * 1000.0 >= BudgetMs) break;
+		}
+	}
+
+	if (!IsSpawnPending())
+	{
+		PendingSpawnTransforms.Empty();
+		PendingSpawnCursor = 0;
+	}
 }
 
 void ABFlock::UpdateBuffers(int32 NewCount)
@@ -78,6 +158,9 @@ void ABFlock::AddInstances(int32 NumToAdd)
 {
 	// SetActorTickEnabled(false);
 	if (NumToAdd <= 0) return;
+
+	// Buffers are sized from the ISM count, so a time-sliced spawn has to be complete first
+	if (IsSpawnPending()) SpawnPendingInstances(0.f);
 	
 	UpdateBuffers(GetInstanceCount() + NumToAdd);
 	
@@ -102,6 +185,8 @@ void ABFlock::RemoveInstances(int32 NumToRemove)
 {
 	SetActorTickEnabled(false);
 	if (ensure(NumToRemove <= 0)) return;
+
+	if (IsSpawnPending()) SpawnPendingInstances(0.f);
 	
 	const int32 NewInstanceCount = FMath::Max(0, GetInstanceCount() - NumToRemove);
 
@@ -170,254 +255,247 @@ UE_NODISCARD FORCEINLINE FVector LerpNormals(const FVector& A, const FVector& B,
 }
 
 
-// Calculate separation steering force
-FVector ABFlock::Separate(TArray<FVector>& BoidsPositions, int CurrentIndex) const
+// Change Direction when boids get near the bounds
+void ABFlock::Redirect(FVector& Direction, const int32 CurrentIndex)
 {
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Separate"), STAT_Separate, STATGROUP_BoidProfiling);
-	
-	FVector Steering = FVector::ZeroVector;
-	int32 FlockCount = 0;
-	FVector SeparationDirection = FVector::ZeroVector;
-	float ProximityFactor = 0.0f;
-	
-	FTransform InstanceTransform;
-	ISMComp->GetInstanceTransform(CurrentIndex,InstanceTransform, true);
-	const FVector ForwardVector = InstanceTransform.GetUnitAxis(EAxis::X);
-	const FVector CurrentPosition = BoidsPositions[CurrentIndex];
+	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Redirect"), STAT_Redirect, STATGROUP_BoidProfiling);
 	
-	//get separation steering force for each of the boid's flockmates
-	for (FVector OtherPosition : BoidsPositions)
+	FTransform Transform{NoInit};
+	ISMComp->GetInstanceTransform(CurrentIndex,Transform, true);
+
+	FVector ActorLocation = GetActorLocation();
+	// const float AdjustedSpreadRadius = SpreadRadius + GetActorLocation().Size();
+	if ((Transform.GetTranslation() - ActorLocation).SizeSquared() > FMath::Square(SpreadRadius - ProximityRadius - UE_DOUBLE_KINDA_SMALL_NUMBER))
 	{
-		// Ignore self and filer out irrelevant far away birds
-		const float ProximityDistanceSquared = FVector::DistSquared(CurrentPosition,OtherPosition);
-		if (CurrentPosition == OtherPosition || ProximityDistanceSquared > FMath::Square(ProximityRadius))
-		{
-			continue;
-		}
-		SeparationDirection = CurrentPosition - OtherPosition;
-		SeparationDirection = SeparationDirection.GetSafeNormal();
-		ProximityFactor = 1.0 - (SeparationDirection.Size() / ProximityRadius);
+		const double Dist = (Transform.GetTranslation() - ActorLocation).Size();
+		const FVector Dir = (Transform.GetTranslation() - ActorLocation) / Dist;
+
+		// Calculate CrossProduct
+		// FVector RightAxis = Direction ^ Dir;
+		FVector RightAxis = Direction.Cross(Dir);
 
-		if (ProximityFactor < 0.1f)
+		FVector TargetDirection;
+		if(RightAxis.SizeSquared() > UE_DOUBLE_KINDA_SMALL_NUMBER)
 		{
-			continue;
+			RightAxis = RightAxis.GetUnsafeNormal();
+			TargetDirection = RightAxis.RotateAngleAxisRad(UE_DOUBLE_PI / 2.0, Dir).RotateAngleAxisRad(-UE_DOUBLE_PI / 4.0, RightAxis);
 		}
-		// filter other boids which outside of the field of view
-		if (FVector::DotProduct(ForwardVector, (OtherPosition - CurrentPosition).GetSafeNormal()) <= -1.0f)
+		else
 		{
-			continue;
+			TargetDirection = -Dir;
 		}
-		//add steering force for each nearby boid
-		Steering += (ProximityFactor * SeparationDirection);
-		FlockCount++;
-	}
 
-	if (FlockCount > 0)
-	{
-		Steering /= FlockCount;
-		Steering *= SeparationStrength;
-		return Steering;
+		const double Alpha = FMath::GetMappedRangeValueUnclamped<double, double>({SpreadRadius - ProximityRadius - UE_DOUBLE_KINDA_SMALL_NUMBER, SpreadRadius},
+																				{0.0, 1.0}, Dist);
+		Direction = LerpNormals(Direction, TargetDirection, Alpha);
 	}
-	else return FVector::ZeroVector;
 }
 
-FVector ABFlock::Separate(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const
+// Cached lists stay valid while no boid has travelled more than half the skin since they were built,
+// since two boids closing in on each other can then cover at most the whole skin between them
+bool ABFlock::NeedsNeighborRebuild() const
 {
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Separate_Rel"), STAT_Separate, STATGROUP_BoidProfiling);
+	if (NeighborBuildLocations.Num() != NumInstances || NeighborOffsets.Num() != NumInstances + 1) return true;
+	if (NeighborBuildRadius != ProximityRadius + NeighborSkin) return true;
 
-	FTransform CurrentTransform{NoInit};
-	ISMComp->GetInstanceTransform(CurrentIndex, CurrentTransform);
-	
-	FVector Steering = Velocities[CurrentIndex];
-	
-	for (const int32 OtherBoidIndex : OtherRelevantBoidIndices)
+	const double MaxDisplacementSquared = FMath::Square(NeighborSkin * 0.5);
+	for (int32 i = 0; i < NumInstances; ++i)
 	{
-		FTransform OtherTransform{NoInit};
-		ISMComp->GetInstanceTransform(OtherBoidIndex, OtherTransform);
-
-		const FVector Translation = FTransform::SubtractTranslations(CurrentTransform, OtherTransform);
-		if (UNLIKELY(Translation.SizeSquared() < UE_DOUBLE_KINDA_SMALL_NUMBER)) continue;
-
-		const double Dist = Translation.Size();
-
-		Steering += Translation * (((1.0 - (Dist / ProximityRadius)) / Dist) * SeparationStrength);
+		if (FVector::DistSquared(BoidCurrentLocations[i], NeighborBuildLocations[i]) > MaxDisplacementSquared) return true;
 	}
-	Steering.Normalize();
-	
-	return  Steering;
+	return false;
 }
 
-FVector ABFlock::Align(TArray<FVector>& BoidsPositions, const int32 CurrentIndex) const
+void ABFlock::BuildNeighborLists()
 {
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Align"), STAT_Align, STATGROUP_BoidProfiling);
-	
-	FVector Steering = FVector::ZeroVector;
-	int32 FlockCount = 0;
+	SCOPE_CYCLE_COUNTER(STAT_BuildNeighborLists);
+	SET_DWORD_STAT(STAT_NeighborListRebuilds, ++NeighborRebuildCount);
 
-	FTransform InstanceTransform;
-	ISMComp->GetInstanceTransform(CurrentIndex,InstanceTransform, true);
-	const FVector ForwardVector = InstanceTransform.GetUnitAxis(EAxis::X);
+	NeighborBuildRadius = ProximityRadius + NeighborSkin;
+	const double ListRadiusSquared = FMath::Square(NeighborBuildRadius);
 
-	const FVector CurrentPosition = BoidsPositions[CurrentIndex];
-	for (FVector OtherPosition : BoidsPositions)
-	{		
-		const float ProximityDistanceSquared = FVector::DistSquared(CurrentPosition,OtherPosition);
-		
-		// Ignore self and filter out other birds that are far away and irrelevant
-		if (OtherPosition == CurrentPosition || ProximityDistanceSquared > FMath::Square(ProximityRadius))
-		{
-			continue;
-		}
-	
-		// filter other birds which are outside of the field of view angle
-		if (FVector::DotProduct(ForwardVector, (OtherPosition - CurrentPosition).GetSafeNormal()) <= 0.5f)
+	// Gather every boid within ProximityRadius + NeighborSkin
+	NeighborScratch.SetNum(NumInstances);
+	ParallelFor(NumInstances, [&](const int32 i) -> void
+	{
+		TArray<int32>& Neighbors = NeighborScratch[i];
+		Neighbors.Reset();
+
+		const FVector CurrentPosition = BoidCurrentLocations[i];
+		for (int32 j = 0; j < NumInstances; ++j)
 		{
-			continue;
+			if (j != i && FVector::DistSquared(CurrentPosition, BoidCurrentLocations[j]) <= ListRadiusSquared)
+			{
+				Neighbors.Add(j);
+			}
 		}
-		
-		FVector OtherVelocity = (CurrentPosition - OtherPosition) / GetWorld()->GetDeltaSeconds();
-		Steering += OtherVelocity.GetSafeNormal();
-		FlockCount++;
-	}
-	
-	if (FlockCount > 0)
+	});
+
+	// Flatten into CSR
+	NeighborOffsets.SetNumUninitialized(NumInstances + 1);
+	NeighborOffsets[0] = 0;
+	for (int32 i = 0; i < NumInstances; ++i)
 	{
-		//get alignment force to average flock direction
-		Steering /= FlockCount;
-		Steering *= AlignmentStrength;
-		return Steering;
+		NeighborOffsets[i + 1] = NeighborOffsets[i] + NeighborScratch[i].Num();
 	}
-	else return FVector::ZeroVector;
+	NeighborIndices.SetNumUninitialized(NeighborOffsets[NumInstances]);
+
+	ParallelFor(NumInstances, [&](const int32 i) -> void
+	{
+		FMemory::Memcpy(NeighborIndices.GetData() + NeighborOffsets[i], NeighborScratch[i].GetData(), NeighborScratch[i].Num() * sizeof(int32));
+	});
+
+	NeighborBuildLocations.Reset(NumInstances);
+	NeighborBuildLocations.Append(BoidCurrentLocations.GetData(), NumInstances);
+	FramesSinceNeighborRebuild = 0;
 }
 
-// Calculate aligning steering force of relevant boids only
-FVector ABFlock::Align(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const
+namespace BoidSteering
 {
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Align_rel"), STAT_Align, STATGROUP_BoidProfiling);
+	enum ERuleBits : uint32
+	{
+		Separate		= 1 << 0,
+		Align			= 1 << 1,
+		Cohere			= 1 << 2,
+		FieldOfView		= 1 << 3,
+		SphereBounds	= 1 << 4,
+		NumPipelines	= 1 << 5
+	};
+
+	// Compile-time rule set, one per combination of ERuleBits
+	template <uint32 Mask>
+	struct TRuleSet
+	{
+		static constexpr bool bSeparate = (Mask & Separate) != 0;
+		static constexpr bool bAlign = (Mask & Align) != 0;
+		static constexpr bool bCohere = (Mask & Cohere) != 0;
+		static constexpr bool bFieldOfView = (Mask & FieldOfView) != 0;
+		static constexpr EBoidBounds Bounds = (Mask & SphereBounds) != 0 ? EBoidBounds::Sphere : EBoidBounds::None;
+	};
+}
 
-	FVector Steering = FVector::ZeroVector;
-	if (OtherRelevantBoidIndices.IsEmpty()) return Steering;
+// Separation, alignment and cohesion in a single pass over the cached neighbor lists. Inactive rules and FOV tests are compiled out
+template <typename RuleSet>
+void ABFlock::SimulateSteering(const float DeltaTime)
+{
+	SCOPE_CYCLE_COUNTER(STAT_Steering);
 
-	for (const int32 OtherBoidIndex : OtherRelevantBoidIndices)
-	{
-		Steering += BoidCurrentLocations[OtherBoidIndex];
-	}
+	const double ProximityRadiusSquared = FMath::Square(ProximityRadius);
 
-	Steering /= OtherRelevantBoidIndices.Num();
-	Steering.Normalize();
+	// Separation pushes along the unit direction, so its proximity factor is the same for every pair
+	const double SeparationScale = (1.0 - (1.0 / ProximityRadius)) * SeparationStrength;
 
-	const double Alpha = FMath::Min(1.0, static_cast<double>(OtherRelevantBoidIndices.Num()) / 15.0) * AlignmentStrength;
-	Steering = LerpNormals(Velocities[CurrentIndex], Steering, Alpha);
+	ParallelFor(NumInstances, [&](const int32 i) -> void
+	{
+		const FVector CurrentPosition = BoidCurrentLocations[i];
 
-	return Steering;
-}
+		FVector ForwardVector = FVector::ForwardVector;
+		if constexpr (RuleSet::bFieldOfView)
+		{
+			FTransform InstanceTransform{NoInit};
+			ISMComp->GetInstanceTransform(i, InstanceTransform, true);
+			ForwardVector = InstanceTransform.GetUnitAxis(EAxis::X);
+		}
 
-// Calculate Grouping-up steering force
-FVector ABFlock::Cohere(TArray<FVector>& BoidsPositions, int CurrentIndex) const 
-{
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Cohere"), STAT_Cohere, STATGROUP_BoidProfiling);
-	
-	FVector Steering = FVector::ZeroVector;
-	int32 FlockCount = 0;
-	FVector AveragePosition = FVector::ZeroVector;
+		FVector SeparationSum = FVector::ZeroVector;
+		FVector AlignmentSum = FVector::ZeroVector;
+		FVector CohesionSum = FVector::ZeroVector;
+		int32 SeparationCount = 0;
+		int32 AlignmentCount = 0;
+		int32 CohesionCount = 0;
 
-	FTransform InstanceTransform;
-	ISMComp->GetInstanceTransform(CurrentIndex,InstanceTransform, true);
-	const FVector ForwardVector = InstanceTransform.GetUnitAxis(EAxis::X);
+		for (const int32 OtherIndex : GetNeighbors(i))
+		{
+			const FVector OtherPosition = BoidCurrentLocations[OtherIndex];
+
+			// Ignore self and filter out far away boids
+			if (OtherPosition == CurrentPosition || FVector::DistSquared(CurrentPosition, OtherPosition) > ProximityRadiusSquared)
+			{
+				continue;
+			}
+
+			const FVector ToOther = (OtherPosition - CurrentPosition).GetSafeNormal();
+
+			// Without FOV filtering every flockmate counts as straight ahead, and the per-rule tests fold away
+			const double ViewDot = RuleSet::bFieldOfView ? FVector::DotProduct(ForwardVector, ToOther) : 1.0;
+
+			if constexpr (RuleSet::bSeparate)
+			{
+				if (ViewDot > -1.0)
+				{
+					SeparationSum -= ToOther;
+					++SeparationCount;
+				}
+			}
+			if constexpr (RuleSet::bAlign)
+			{
+				if (ViewDot > 0.5)
+				{
+					AlignmentSum -= ToOther;
+					++AlignmentCount;
+				}
+			}
+			if constexpr (RuleSet::bCohere)
+			{
+				if (ViewDot > -0.5)
+				{
+					CohesionSum += OtherPosition;
+					++CohesionCount;
+				}
+			}
+		}
 
-	const FVector CurrentPosition = BoidsPositions[CurrentIndex];
-	for (FVector OtherPosition : BoidsPositions)
-	{
-		// Filter out birds that are far away and irrelevant
-		const float ProximityDistanceSquared = FVector::DistSquared(CurrentPosition, OtherPosition);
-		if (ProximityDistanceSquared > FMath::Square(ProximityRadius))
+		FVector Acceleration = FVector::ZeroVector;
+		if constexpr (RuleSet::bSeparate)
 		{
-			continue;
+			if (SeparationCount > 0) Acceleration += SeparationSum * (SeparationScale / SeparationCount);
 		}
-		// ignore self
-		if (OtherPosition == CurrentPosition)
+		if constexpr (RuleSet::bAlign)
 		{
-			continue;
+			if (AlignmentCount > 0) Acceleration += AlignmentSum * (AlignmentStrength / AlignmentCount);
 		}
-		// filter other boids which outside of the field of view
-		if (FVector::DotProduct(ForwardVector, (OtherPosition - CurrentPosition).GetSafeNormal()) <= -0.5f)
+		if constexpr (RuleSet::bCohere)
 		{
-			continue; //flockmate is outside viewing angle, disregard this flockmate and continue the loop
+			if (CohesionCount > 0) Acceleration += (CohesionSum / CohesionCount - CurrentPosition) * CohesionStrength;
 		}
-		AveragePosition += OtherPosition;
-		FlockCount++;
-	}
-	
-	if (FlockCount > 0)
-	{
-		AveragePosition /= FlockCount;
-		Steering = AveragePosition - CurrentPosition;
-		Steering.GetSafeNormal() -= BoidsVelocities[CurrentIndex].GetSafeNormal();
-		Steering *= CohesionStrength;
-		return Steering;
-	}
-	else return FVector::ZeroVector;
-}
-
-FVector ABFlock::Cohere(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const
-{
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Cohere_rel"), STAT_Cohere, STATGROUP_BoidProfiling);
-
-	FVector Steering = FVector::ZeroVector;
-
-	if (OtherRelevantBoidIndices.IsEmpty()) return Steering;
-	
-	for (const int32 OtherBoidIndex : OtherRelevantBoidIndices)
-	{
-		FTransform OtherTransform{NoInit};
-		ISMComp->GetInstanceTransform(OtherBoidIndex, OtherTransform, true);
 
-		Steering += OtherTransform.GetTranslation();
-	}
-	Steering /= OtherRelevantBoidIndices.Num();
-
-	const FVector DirToAverageLocation = (Steering - BoidCurrentLocations[CurrentIndex].GetSafeNormal());
+		//Keep boids inside the bounds
+		if constexpr (RuleSet::Bounds == EBoidBounds::Sphere)
+		{
+			Redirect(BoidsVelocities[i], i);
+		}
 
-	const double Alpha = FMath::GetMappedRangeValueClamped<double, double>({0.0, 15.0}, {0.0, CohesionStrength}, static_cast<double>(OtherRelevantBoidIndices.Num()));
-	Steering = LerpNormals(Velocities[CurrentIndex], DirToAverageLocation, Alpha);
-	
-	return Steering;
+		//update velocities
+		BoidsVelocities[i] += (Acceleration * DeltaTime);
+		BoidsVelocities[i] = BoidsVelocities[i].GetClampedToSize(MinMovementSpeed, MaxMovementSpeed);
+	});
 }
 
-// Change Direction when boids get near the bounds
-void ABFlock::Redirect(FVector& Direction, const int32 CurrentIndex)
+template <uint32... Masks>
+const ABFlock::FSteeringPipeline* ABFlock::GetSteeringPipelines(TIntegerSequence<uint32, Masks...>)
 {
-	DECLARE_SCOPE_CYCLE_COUNTER(TEXT("Redirect"), STAT_Redirect, STATGROUP_BoidProfiling);
-	
-	FTransform Transform{NoInit};
-	ISMComp->GetInstanceTransform(CurrentIndex,Transform, true);
+	static const FSteeringPipeline Pipelines[] = { &ABFlock::SimulateSteering<BoidSteering::TRuleSet<Masks>>... };
+	return Pipelines;
+}
 
-	FVector ActorLocation = GetActorLocation();
-	// const float AdjustedSpreadRadius = SpreadRadius + GetActorLocation().Size();
-	if ((Transform.GetTranslation() - ActorLocation).SizeSquared() > FMath::Square(SpreadRadius - ProximityRadius - UE_DOUBLE_KINDA_SMALL_NUMBER))
+void ABFlock::SelectSteeringPipeline()
+{
+	// A rule with zero strength, or separation whose proximity factor falls under its cutoff, contributes nothing
+	uint32 Mask = 0;
+	if (SeparationStrength > 0.f && 1.0 - (1.0 / ProximityRadius) >= 0.1) Mask |= BoidSteering::Separate;
+	if (AlignmentStrength > 0.f) Mask |= BoidSteering::Align;
+	if (CohesionStrength > 0.f) Mask |= BoidSteering::Cohere;
+	if (bFieldOfViewFiltering) Mask |= BoidSteering::FieldOfView;
+	if (Bounds == EBoidBounds::Sphere) Mask |= BoidSteering::SphereBounds;
+
+	if (SteeringPipeline == nullptr || Mask != SteeringPipelineMask)
 	{
-		const double Dist = (Transform.GetTranslation() - ActorLocation).Size();
-		const FVector Dir = (Transform.GetTranslation() - ActorLocation) / Dist;
-
-		// Calculate CrossProduct
-		// FVector RightAxis = Direction ^ Dir;
-		FVector RightAxis = Direction.Cross(Dir);
-
-		FVector TargetDirection;
-		if(RightAxis.SizeSquared() > UE_DOUBLE_KINDA_SMALL_NUMBER)
-		{
-			RightAxis = RightAxis.GetUnsafeNormal();
-			TargetDirection = RightAxis.RotateAngleAxisRad(UE_DOUBLE_PI / 2.0, Dir).RotateAngleAxisRad(-UE_DOUBLE_PI / 4.0, RightAxis);
-		}
-		else
-		{
-			TargetDirection = -Dir;
-		}
+		static const FSteeringPipeline* const Pipelines = GetSteeringPipelines(TMakeIntegerSequence<uint32, BoidSteering::NumPipelines>{});
 
-		const double Alpha = FMath::GetMappedRangeValueUnclamped<double, double>({SpreadRadius - ProximityRadius - UE_DOUBLE_KINDA_SMALL_NUMBER, SpreadRadius},
-																				{0.0, 1.0}, Dist);
-		Direction = LerpNormals(Direction, TargetDirection, Alpha);
+		SteeringPipelineMask = Mask;
+		SteeringPipeline = Pipelines[Mask];
 	}
+	SET_DWORD_STAT(STAT_SteeringPipeline, SteeringPipelineMask);
 }
 
 void ABFlock::Tick(float DeltaTime)
@@ -425,6 +503,13 @@ void ABFlock::Tick(float DeltaTime)
 	SCOPE_CYCLE_COUNTER(STAT_Simulate_GameThread);
 	Super::Tick(DeltaTime);
 
+	// Hold the simulation until a time-sliced spawn has finished
+	if (IsSpawnPending())
+	{
+		SpawnPendingInstances(SpawnBudgetMs);
+		return;
+	}
+
 	// Fetch Boid Locations
 	ParallelFor(NumInstances, [&](const int32 i) -> void
 	{
@@ -435,24 +520,22 @@ void ABFlock::Tick(float DeltaTime)
 		BoidCurrentLocations[i] = InstanceTransform.GetLocation();
 	});
 
-	//Multithreading allowing multiple iterations to be executed concurrently
-	ParallelFor(NumInstances, [&](const int32 i) -> void
+	// Reuse cached neighbor lists until some boid drifts too far into the skin
+	if (NeedsNeighborRebuild())
 	{
-		FVector Acceleration = FVector::ZeroVector;
-
-		//TODO Pre-filter near flockmates and only pass relevant array of boids for force calculations
-		//apply steering forces to acceleration vector
-		Acceleration += Separate(BoidCurrentLocations,i);
-		Acceleration += Align(BoidCurrentLocations,i);
-		Acceleration += Cohere(BoidCurrentLocations,i);
-		
-		//Keep boids inside the bounds
-		Redirect(BoidsVelocities[i], i);
+		BuildNeighborLists();
+	}
+	else
+	{
+		++FramesSinceNeighborRebuild;
+	}
+	++SimulatedFrameCount;
+	SET_DWORD_STAT(STAT_FramesSinceNeighborRebuild, FramesSinceNeighborRebuild);
+	SET_FLOAT_STAT(STAT_NeighborRebuildRate, static_cast<float>(NeighborRebuildCount) / SimulatedFrameCount);
 
-		//update velocities
-		BoidsVelocities[i] += (Acceleration * DeltaTime);
-		BoidsVelocities[i] = BoidsVelocities[i].GetClampedToSize(MinMovementSpeed, MaxMovementSpeed);
-	});
+	//apply steering forces through the kernel specialized for the enabled rules
+	SelectSteeringPipeline();
+	(this->*SteeringPipeline)(DeltaTime);
 
 	// Move Boids
 	TArray<FTransform> TempBuffer;
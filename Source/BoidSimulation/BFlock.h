@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/Actor.h"
+#include "Templates/IntegerSequence.h"
 
 #include "BFlock.generated.h"
 
@@ -12,6 +13,14 @@ class UInstancedStaticMeshComponent;
 
 #define DEBUG_ENABLED 0
 
+// Volume boids are steered back into when they approach its edge
+UENUM(BlueprintType)
+enum class EBoidBounds : uint8
+{
+	Sphere,		// Redirect boids once they get within ProximityRadius of SpreadRadius
+	None		// Let boids roam freely
+};
+
 /**
  * The ABFlock class represents a flocking behavior simulation using instanced static meshes.
  * Adjustable parameters are exposed to UI and help to dial in specific behaviour.
@@ -47,20 +56,68 @@ protected:
 	FVector InitialSpawnScale;
 
 	UBoxComponent* Box;
+
+	//SPAWNING
+protected:
+
+	// Transforms (component space) still waiting to be added to ISMComp when spawning is time-sliced
+	TArray<FTransform> PendingSpawnTransforms;
+	int32 PendingSpawnCursor = 0;
+
+	// Fills transforms and initial velocities for NumInstances boids in parallel, one seeded stream per chunk
+	void GenerateSpawnData();
+
+	// Adds pending instances to ISMComp in batches, stopping once BudgetMs has been spent. Non-positive budget adds all remaining instances in one batch
+	void SpawnPendingInstances(const float BudgetMs);
+
+	FORCEINLINE bool IsSpawnPending() const { return PendingSpawnCursor < PendingSpawnTransforms.Num(); }
 	
 	//MOVEMENT
 protected:
 	
-	FVector Align(TArray<FVector>& BoidsPositions, const int32 CurrentIndex) const ;
-	FVector Align(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const;
-	
-	FVector Separate(TArray<FVector>& BoidsPositions, const int32 CurrentIndex) const;
-	FVector Separate(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const;
+	void Redirect(FVector& Direction, const int32 CurrentIndex);
 
-	FVector Cohere(TArray<FVector>& BoidsPositions, const int32 CurrentIndex) const;
-	FVector Cohere(const TArrayView<FVector>& Velocities, const int32 CurrentIndex, const TConstArrayView<int32>& OtherRelevantBoidIndices) const;
+	// Steering kernel specialized on the active rule set, see BoidSteering::TRuleSet
+	using FSteeringPipeline = void (ABFlock::*)(const float);
 
-	void Redirect(FVector& Direction, const int32 CurrentIndex);
+	template <typename RuleSet>
+	void SimulateSteering(const float DeltaTime);
+
+	template <uint32... Masks>
+	static const FSteeringPipeline* GetSteeringPipelines(TIntegerSequence<uint32, Masks...>);
+
+	// Picks the kernel instantiation matching current parameters, only re-resolved when they change
+	void SelectSteeringPipeline();
+
+	FSteeringPipeline SteeringPipeline = nullptr;
+	uint32 SteeringPipelineMask = 0;
+
+	//NEIGHBOR LISTS
+protected:
+
+	// Verlet neighbor lists in CSR form: neighbors of boid i are NeighborIndices[NeighborOffsets[i] .. NeighborOffsets[i + 1])
+	TArray<int32> NeighborOffsets;
+	TArray<int32> NeighborIndices;
+
+	// Boid locations and list radius at the time the neighbor lists were last built
+	TArray<FVector> NeighborBuildLocations;
+	float NeighborBuildRadius = 0.f;
+	int32 FramesSinceNeighborRebuild = 0;
+
+	// Running totals behind the rebuild rate stat
+	uint32 NeighborRebuildCount = 0;
+	uint32 SimulatedFrameCount = 0;
+
+	// Per-boid scratch filled in parallel during a rebuild, kept around to avoid reallocating every build
+	TArray<TArray<int32>> NeighborScratch;
+
+	bool NeedsNeighborRebuild() const;
+	void BuildNeighborLists();
+
+	FORCEINLINE TConstArrayView<int32> GetNeighbors(const int32 Index) const
+	{
+		return TConstArrayView<int32>(NeighborIndices.GetData() + NeighborOffsets[Index], NeighborOffsets[Index + 1] - NeighborOffsets[Index]);
+	}
 
 public:
 
@@ -94,6 +151,12 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments", meta = (ClampMin = "30.0", ClampMax = "1200.0", UIMin = "30.0", UIMax = "1200.0"));
 	float ProximityRadius = 70.f;
 
+	// Extra margin beyond ProximityRadius kept in the cached neighbor lists. Lists are rebuilt once a boid travels half the skin,
+	// so at MaxMovementSpeed they last about (NeighborSkin / 2) / (MaxMovementSpeed * DeltaTime) frames, e.g. 2-3 frames for the
+	// defaults at 60 fps. Raise it for fast flocks or low frame rates; larger skin means fewer rebuilds but longer lists
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments", meta = (ClampMin = "0", ClampMax = "300.0", UIMin = "0", UIMax = "300.0"));
+	float NeighborSkin = 50.f;
+
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments", meta = (UIMin = "90.0", UIMax = "650.0"));
 	float MinMovementSpeed = 90.f;
 
@@ -103,11 +166,24 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments", meta = (UIMin = "400.0", UIMax = "3500.0"));
 	float SpreadRadius = 400.f;
 
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments");
+	EBoidBounds Bounds = EBoidBounds::Sphere;
+
+	// Ignore flockmates outside each rule's viewing angle
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Adjustments");
+	bool bFieldOfViewFiltering = true;
+
+	// Seed for spawn placement, same seed and count always produce the same flock
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Spawning")
+	int32 SpawnSeed = 0;
+
+	// Per-frame time budget for adding instances on startup. 0 spawns the whole flock in BeginPlay, or the remainder on the next Tick if changed mid-spawn
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid Spawning", meta = (ClampMin = "0", UIMin = "0", UIMax = "16.0"))
+	float SpawnBudgetMs = 0.f;
+
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Boid DEBUG")
 	bool bToggleProximityDebug = true;
 	
 	//Helper functions
-	static inline FVector RandomPointInBoundingBox(const FVector& Center, const FVector& HalfSize) { return FMath::RandPointInBox(FBox(Center - HalfSize, Center + HalfSize)); }
-	
 	FVector GetVectorArrayAverage(const TArray<FVector>& Vectors);
 };